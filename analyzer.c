@@ -0,0 +1,703 @@
+/* analyzer.c - Offline analysis of dut and beacon output logs           */
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#define USAGE "\
+Usage: %s [-t <n>] [-p <ms>] [-T <v>] [-J <v>] [-L <v>] [-w <ms>]\n\
+          <logfile>...\n"
+#define HELP "\n\
+Analyzes captured dut and beacon output (stdout, run with -d for\n\
+beacon).  Each file is memory-mapped and split across threads.\n\
+\n\
+For dut logs, tester requests (ids 0x7D0/0x71F) are paired with the\n\
+DuT responses (id 0x7E8) and the response times are reported per\n\
+service, along with a timeline around each simulated crash.  The\n\
+response time of a multi-frame request is measured from its last\n\
+consecutive frame, so it excludes the ISO-TP transfer itself.\n\
+\n\
+For beacon logs, the frame inter-arrival times and losses are\n\
+reported per CAN id and compared with the beacon settings given\n\
+below (use the same values that beacon was run with).  The loss\n\
+rate, share of jittered frames and largest extra delay expected\n\
+from those settings are shown under each id, and any id outside\n\
+them is flagged.\n\
+\n\
+Options:\n\
+-t <n>  Number of threads, default is the number of CPUs.\n\
+-p <ms> Configured beacon period; default is to use the most\n\
+        common un-jittered inter-arrival time of each id.\n\
+-T <v>  Configured beacon timing jitter (percent of period).\n\
+-J <v>  Configured percentage of frames affected by jitter.\n\
+-L <v>  Configured beacon frame loss percentage.\n\
+-w <ms> Width of the timeline printed either side of a crash,\n\
+        default is 200ms.\n\
+\n\
+"
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/* For convenience... */
+typedef unsigned char uchar;
+
+/* Histograms are in milliseconds, the last bucket catches the rest */
+#define HBUCKETS 4096
+
+#define MAXIDS   4096         /* beacon CAN ids tracked per file     */
+#define MAXLEAD  8            /* responses before a chunk's first req */
+#define MAXCRASH 1024         /* crash markers per chunk             */
+#define NOID     0xFFFFFFFFU  /* drop lines from older beacons       */
+
+/* Per-service request/response statistics */
+struct service {
+  long reqs, answered, negative, unanswered;
+  long *hist;                 /* response time histogram (ms)   */
+};
+
+/* Per-CAN id beacon statistics */
+struct beaconid {
+  unsigned int id;
+  long frames, dropped, jittered;
+  long *hist;                 /* inter-arrival histogram (ms)   */
+};
+
+/* A table of beacon ids; standard (11-bit) ids are also indexed
+ * directly, so the common case is a single lookup per line */
+struct idtable {
+  struct beaconid ids[MAXIDS];
+  int n;
+  short sff[2048];            /* index + 1, or 0                */
+};
+
+/* A response seen before the first request of a chunk */
+struct lead {
+  int svc, nrc;
+  long t;
+};
+
+/* A crash start/end marker; 't' is -1 until resolved */
+struct crash {
+  int end;
+  long off, t;
+};
+
+/* Everything one thread learns about its chunk of a file */
+struct chunk {
+  const char *beg, *end, *base;
+  long firstT, lastT;
+  struct service svc[256];
+  struct idtable ids;
+  struct lead lead[MAXLEAD];
+  int nlead, sawReq;
+  int pendSvc;                /* outstanding request, or -1     */
+  long pendT;
+  long leadCfT;               /* last consecutive frame before the
+				 first request or response, or -1 */
+  struct crash crash[MAXCRASH];
+  int ncrash;
+  long lines, frames;
+};
+
+/* Command line settings */
+
+int nthreads = 0;
+int period   = 0;
+int timing   = 0;
+int jitter   = 0;
+int loss     = 0;
+int window   = 200;
+
+/* Totals over all files */
+
+struct service svcTotal[256];
+struct idtable idTotal;
+long linesTotal = 0;
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Histogram helpers */
+
+void histAdd(long **h, long v) {
+  if (! *h) *h = calloc(HBUCKETS, sizeof(long));
+  if (v < 0) v = 0;
+  if (v >= HBUCKETS) v = HBUCKETS - 1;
+  (*h)[v]++;
+}
+
+void histMerge(long **to, long *from) {
+  int i;
+  if (! from) return;
+  if (! *to) *to = calloc(HBUCKETS, sizeof(long));
+  for (i = 0; i < HBUCKETS; i++) (*to)[i] += from[i];
+}
+
+/* Value at the given fraction (0..1) of the distribution, or -1 */
+long histPct(long *h, double f) {
+  long n = 0, k = 0;
+  int i;
+  if (! h) return -1;
+  for (i = 0; i < HBUCKETS; i++) n += h[i];
+  if (n == 0) return -1;
+  for (i = 0; i < HBUCKETS; i++) {
+    k += h[i];
+    if (k >= f * n && k > 0) return i;
+  }
+  return HBUCKETS - 1;
+}
+
+double histMean(long *h) {
+  double s = 0;
+  long n = 0;
+  int i;
+  if (! h) return 0;
+  for (i = 0; i < HBUCKETS; i++) { s += (double)i * h[i]; n += h[i]; }
+  return n ? s / n : 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Minimal, allocation-free field parsers.  Each advances *pp past
+ * what it consumed and returns -1 if the text doesn't match. */
+
+void skipSpace(const char **pp, const char *e) {
+  while (*pp < e && **pp == ' ') (*pp)++;
+}
+
+long getDec(const char **pp, const char *e) {
+  long v = 0;
+  const char *p = *pp;
+  if (p >= e || *p < '0' || *p > '9') return -1;
+  while (p < e && *p >= '0' && *p <= '9') v = v * 10 + (*p++ - '0');
+  *pp = p;
+  return v;
+}
+
+long getHex(const char **pp, const char *e) {
+  long v = 0;
+  int d;
+  const char *p = *pp;
+  for (; p < e; p++) {
+    if (*p >= '0' && *p <= '9') d = *p - '0';
+    else if (*p >= 'A' && *p <= 'F') d = *p - 'A' + 10;
+    else if (*p >= 'a' && *p <= 'f') d = *p - 'a' + 10;
+    else break;
+    v = (v << 4) | d;
+  }
+  if (p == *pp) return -1;
+  *pp = p;
+  return v;
+}
+
+/* "<sec>.<ms>" as milliseconds */
+long getTime(const char **pp, const char *e) {
+  long s, ms;
+  skipSpace(pp, e);
+  if ((s = getDec(pp, e)) < 0 || *pp >= e || **pp != '.') return -1;
+  (*pp)++;
+  if ((ms = getDec(pp, e)) < 0) return -1;
+  return s * 1000 + ms;
+}
+
+/* "<id>  [<dlc>] <byte> <byte>..." -- returns the dlc */
+int getFrame(const char **pp, const char *e, unsigned int *id, uchar *d) {
+  long v;
+  int i, dlc;
+  skipSpace(pp, e);
+  if ((v = getHex(pp, e)) < 0) return -1;
+  *id = v;
+  skipSpace(pp, e);
+  if (*pp >= e || **pp != '[') return -1;
+  (*pp)++;
+  if ((dlc = getDec(pp, e)) < 0 || dlc > 8) return -1;
+  (*pp)++;
+  for (i = 0; i < dlc; i++) {
+    skipSpace(pp, e);
+    if ((v = getHex(pp, e)) < 0) return -1;
+    d[i] = v;
+  }
+  return dlc;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Request/response pairing.  A UDS tester has one request in flight
+ * at a time, so a new request means the previous one went unanswered. */
+
+void pairRequest(struct chunk *c, int svc, long t) {
+  if (c->pendSvc >= 0) c->svc[c->pendSvc].unanswered++;
+  c->svc[svc].reqs++;
+  c->pendSvc = svc;
+  c->pendT = t;
+  c->sawReq = 1;
+}
+
+/* Pair a response with the outstanding request; returns 0 if there
+ * was no matching request */
+int pairResponse(struct service *svc, int *pendSvc, long pendT,
+		 int rsvc, int nrc, long t) {
+  if (*pendSvc != rsvc) return 0;
+  if (nrc == 0x78) return 1;        /* responsePending, keep waiting */
+  svc[rsvc].answered++;
+  if (nrc) svc[rsvc].negative++;
+  histAdd(&svc[rsvc].hist, t - pendT);
+  *pendSvc = -1;
+  return 1;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Find (or add) a beacon id in a table */
+
+struct beaconid *findId(struct idtable *t, unsigned int id) {
+  int i;
+  if (id < 2048 && t->sff[id]) return &t->ids[t->sff[id] - 1];
+  if (id >= 2048)
+    for (i = 0; i < t->n; i++) if (t->ids[i].id == id) return &t->ids[i];
+  if (t->n == MAXIDS) return NULL;
+  memset(&t->ids[t->n], 0, sizeof(t->ids[0]));
+  t->ids[t->n].id = id;
+  if (id < 2048) t->sff[id] = t->n + 1;
+  return &t->ids[t->n++];
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Parse one line of dut or beacon output */
+
+void parseLine(struct chunk *c, const char *p, const char *e) {
+  unsigned int id;
+  uchar d[8];
+  long t, delta;
+  int dlc, svc, nrc, pci;
+  struct crash *cr;
+
+  c->lines++;
+
+  /* dut frame: " >" inbound, "< " outbound */
+  if (e - p > 2 && ((p[0] == ' ' && p[1] == '>') ||
+		    (p[0] == '<' && p[1] == ' '))) {
+    int in = (p[1] == '>');
+    p += 2;
+    if ((t = getTime(&p, e)) < 0) return;
+    if ((dlc = getFrame(&p, e, &id, d)) < 2) return;
+    if (c->firstT < 0) c->firstT = t;
+    c->lastT = t;
+    c->frames++;
+    if (c->ncrash && c->crash[c->ncrash - 1].end &&
+	c->crash[c->ncrash - 1].t < 0) c->crash[c->ncrash - 1].t = t;
+
+    pci = d[0] >> 4;
+    if (pci == 2 && in && (id == 0x7d0 || id == 0x71f)) {
+      /* Consecutive frame: restart the timer of the request it
+       * belongs to, so the response time excludes the transfer */
+      if (c->sawReq) {
+	if (c->pendSvc >= 0) c->pendT = t;
+      } else if (! c->nlead) {
+	c->leadCfT = t;
+      }
+      return;
+    }
+    if (pci == 0) svc = d[1];
+    else if (pci == 1) svc = ((d[0] & 0xf) == 0 && d[1] == 0) ? d[6] : d[2];
+    else return;                    /* consecutive / flow control */
+
+    if (in && (id == 0x7d0 || id == 0x71f)) {
+      pairRequest(c, svc, t);
+    } else if (! in && id == 0x7e8) {
+      nrc = 0;
+      if (svc == 0x7f) { svc = d[2]; nrc = (dlc > 3) ? d[3] : 0x10; }
+      else svc = (svc - 0x40) & 0xff;
+      if (! c->sawReq) {
+	if (c->nlead < MAXLEAD) {
+	  c->lead[c->nlead].svc = svc;
+	  c->lead[c->nlead].nrc = nrc;
+	  c->lead[c->nlead].t = t;
+	  c->nlead++;
+	}
+      } else {
+	pairResponse(c->svc, &c->pendSvc, c->pendT, svc, nrc, t);
+      }
+    }
+    return;
+  }
+
+  /* dut crash simulation markers */
+  if (p[0] == '*') {
+    int end;
+    if (e - p > 22 && ! memcmp(p, "* Simulating DuT crash", 22)) end = 0;
+    else if (e - p > 42 &&
+	     ! memcmp(p, "* Simulated DuT crash and restart complete", 42))
+      end = 1;
+    else return;
+    if (c->ncrash == MAXCRASH) return;
+    cr = &c->crash[c->ncrash++];
+    cr->end = end;
+    cr->off = p - c->base;
+    cr->t = end ? -1 : ((c->firstT < 0) ? -1 : c->lastT);
+    /* The request that triggered the crash is never answered; it is
+     * shown in the crash timeline rather than counted */
+    if (! end && c->pendSvc >= 0) c->pendSvc = -1;
+    return;
+  }
+
+  /* beacon frame: "<sec>.<ms> <delta>+[+]  <id>  [<dlc>] ..." */
+  if ((t = getTime(&p, e)) < 0) return;
+  skipSpace(&p, e);
+  if ((delta = getDec(&p, e)) < 0 || p >= e || *p++ != '+') return;
+  {
+    struct beaconid *b;
+    int jittered = (p < e && *p == '+');
+    if (jittered) p++;
+    skipSpace(&p, e);
+    if (p < e && *p == '*') {
+      /* Dropped frame; newer beacons append the id */
+      while (p < e && (*p == '*' || (*p >= 'a' && *p <= 'z') || *p == ' '))
+	p++;
+      id = (p < e) ? getHex(&p, e) : NOID;
+      if ((b = findId(&c->ids, id))) b->dropped++;
+      return;
+    }
+    if (getFrame(&p, e, &id, d) < 0) return;
+    if (! (b = findId(&c->ids, id))) return;
+    b->frames++;
+    if (jittered) b->jittered++;
+    histAdd(&b->hist, delta);
+    c->frames++;
+  }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Thread body: parse every line of one chunk */
+
+void *parseChunk(void *arg) {
+  struct chunk *c = arg;
+  const char *p = c->beg, *nl;
+  while (p < c->end) {
+    nl = memchr(p, '\n', c->end - p);
+    if (! nl) nl = c->end;
+    parseLine(c, p, nl);
+    p = nl + 1;
+  }
+  return NULL;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Print the log lines around a crash, from 'window' ms before it
+ * started until 'window' ms after it recovered (50 lines at most
+ * either side). */
+
+void printTimeline(const char *base, long size, long from, long to,
+		   long ts, long te) {
+  const char *p = base + from, *q, *e = base + size;
+  int n;
+
+  /* Back up over the lines before the crash */
+  for (n = 0; n < 50 && p > base; n++) {
+    const char *l = p - 1, *r;
+    long t;
+    while (l > base && l[-1] != '\n') l--;
+    r = l;
+    if ((r[0] == ' ' && r[1] == '>') || (r[0] == '<' && r[1] == ' ')) {
+      r += 2;
+      if ((t = getTime(&r, p)) >= 0 && ts >= 0 && t < ts - window) break;
+    }
+    p = l;
+  }
+
+  /* Forward to the end of the window after the recovery */
+  q = base + to;
+  for (n = 0; q < e; ) {
+    const char *nl = memchr(q, '\n', e - q), *r = q;
+    long t;
+    if (! nl) nl = e;
+    if ((r[0] == ' ' && r[1] == '>') || (r[0] == '<' && r[1] == ' ')) {
+      r += 2;
+      if ((t = getTime(&r, nl)) >= 0 && te >= 0 && t > te + window) break;
+      if (++n > 50) break;
+    }
+    q = nl + 1;
+  }
+  if (q > e) q = e;
+
+  while (p < q) {
+    const char *nl = memchr(p, '\n', q - p);
+    if (! nl) nl = q;
+    printf("    | %.*s\n", (int)(nl - p), p);
+    p = nl + 1;
+  }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Analyze one log file */
+
+int analyzeFile(const char *fname) {
+  struct stat st;
+  struct chunk *c;
+  pthread_t *tid;
+  const char *base;
+  long carryT = 0, lastT = -1, crashStart = -1, crashOff = 0, size;
+  int fd, i, k, n, carrySvc = -1, ncrashes = 0;
+
+  if ((fd = open(fname, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+    perror(fname);
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+  size = st.st_size;
+  if (size == 0) {
+    close(fd);
+    return 0;
+  }
+  base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    perror(fname);
+    return -1;
+  }
+  madvise((void *)base, size, MADV_SEQUENTIAL);
+
+  /* Split into one chunk per thread, on line boundaries */
+  n = nthreads;
+  if (size < n * 65536L) n = 1 + size / 65536;
+  c = calloc(n, sizeof(struct chunk));
+  tid = calloc(n, sizeof(pthread_t));
+  if (! c || ! tid) {
+    fprintf(stderr, "Error: out of memory\n");
+    return -1;
+  }
+  for (i = 0; i < n; i++) {
+    const char *b = (i == 0) ? base : c[i - 1].end;
+    const char *e = base + (size * (i + 1)) / n;
+    if (e < b) e = b;
+    while (e < base + size && e > base && e[-1] != '\n') e++;
+    c[i].beg = b;
+    c[i].end = e;
+    c[i].base = base;
+    c[i].firstT = c[i].lastT = -1;
+    c[i].pendSvc = -1;
+    c[i].leadCfT = -1;
+    if (pthread_create(&tid[i], NULL, parseChunk, &c[i])) {
+      perror("pthread_create");
+      return -1;
+    }
+  }
+  for (i = 0; i < n; i++) pthread_join(tid[i], NULL);
+
+  /* Stitch the chunks together, in file order */
+  printf("%s:\n", fname);
+  for (i = 0; i < n; i++) {
+    linesTotal += c[i].lines;
+
+    /* Consecutive frames and responses at the head of this chunk
+     * belong to the last request of the previous one */
+    if (c[i].leadCfT >= 0 && carrySvc >= 0) carryT = c[i].leadCfT;
+    for (k = 0; k < c[i].nlead; k++) {
+      struct lead *l = &c[i].lead[k];
+      pairResponse(svcTotal, &carrySvc, carryT, l->svc, l->nrc, l->t);
+    }
+    if (c[i].sawReq) {
+      if (carrySvc >= 0) svcTotal[carrySvc].unanswered++;
+      carrySvc = c[i].pendSvc;
+      carryT = c[i].pendT;
+    }
+
+    for (k = 0; k < 256; k++) {
+      struct service *s = &c[i].svc[k], *to = &svcTotal[k];
+      to->reqs += s->reqs;
+      to->answered += s->answered;
+      to->negative += s->negative;
+      to->unanswered += s->unanswered;
+      histMerge(&to->hist, s->hist);
+      free(s->hist);
+    }
+
+    for (k = 0; k < c[i].ids.n; k++) {
+      struct beaconid *b = &c[i].ids.ids[k];
+      struct beaconid *to = findId(&idTotal, b->id);
+      if (! to) continue;
+      to->frames += b->frames;
+      to->dropped += b->dropped;
+      to->jittered += b->jittered;
+      histMerge(&to->hist, b->hist);
+      free(b->hist);
+    }
+
+    /* Crash windows, with times taken from the surrounding frames */
+    for (k = 0; k < c[i].ncrash; k++) {
+      struct crash *cr = &c[i].crash[k];
+      if (! cr->end) {
+	crashStart = (cr->t >= 0) ? cr->t : lastT;
+	crashOff = cr->off;
+	continue;
+      }
+      if (cr->t < 0) {
+	int j;
+	for (j = i + 1; j < n && c[j].firstT < 0; j++);
+	if (j < n) cr->t = c[j].firstT;
+      }
+      ncrashes++;
+      printf("  crash %d: %ld.%03ld - %ld.%03ld  (%ld ms without traffic)\n",
+	     ncrashes, crashStart / 1000, crashStart % 1000,
+	     cr->t / 1000, cr->t % 1000,
+	     (cr->t >= 0 && crashStart >= 0) ? cr->t - crashStart : -1);
+      printTimeline(base, size, crashOff, cr->off, crashStart, cr->t);
+    }
+    if (c[i].lastT >= 0) lastT = c[i].lastT;
+  }
+  if (carrySvc >= 0) svcTotal[carrySvc].unanswered++;
+
+  munmap((void *)base, size);
+  free(c);
+  free(tid);
+  return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Reports */
+
+void reportServices(void) {
+  int i, any = 0;
+  for (i = 0; i < 256; i++) {
+    struct service *s = &svcTotal[i];
+    if (! s->reqs) continue;
+    if (! any++) {
+      printf("\nResponse times per service (ms):\n");
+      printf("  SID      Reqs  Answered   Neg  Unanswered"
+	     "   min   p50   p90   p99   max    mean\n");
+    }
+    printf("  %02X %9ld %9ld %5ld %11ld", i, s->reqs, s->answered,
+	   s->negative, s->unanswered);
+    if (s->hist)
+      printf(" %5ld %5ld %5ld %5ld %5ld %7.2f\n",
+	     histPct(s->hist, 0), histPct(s->hist, 0.5),
+	     histPct(s->hist, 0.9), histPct(s->hist, 0.99),
+	     histPct(s->hist, 1), histMean(s->hist));
+    else
+      printf("     -     -     -     -     -       -\n");
+  }
+}
+
+/* Is an observed percentage within 3 sigma (plus half a percent
+ * for rounding) of the expected one, over 'n' samples? */
+int pctOk(double obs, double exp, long n) {
+  double p = exp / 100;
+  if (n < 1) return 1;
+  return fabs(obs - exp) <= 300 * sqrt(p * (1 - p) / n) + 0.5;
+}
+
+void reportBeacon(void) {
+  int i, k, r;
+  if (! idTotal.n) return;
+  printf("\nBeacon inter-arrival times per id (ms):\n");
+  printf("   ID       Frames  Dropped  Loss%%  Period  Jit%%"
+	 "   p50   p99   max    mean  MaxErr\n");
+  for (i = 0; i < idTotal.n; i++) {
+    struct beaconid *b = &idTotal.ids[i];
+    long total = b->frames + b->dropped;
+    long nominal = period, best = 0, extra, maxExtra;
+    double lossPct, jitPct, expLoss, expJit;
+    if (b->id == NOID) {
+      printf("   (none)  %8s %8ld\n", "-", b->dropped);
+      continue;
+    }
+    if (! nominal && b->hist) {
+      /* Most common inter-arrival time */
+      for (k = 1; k < HBUCKETS - 1; k++)
+	if (b->hist[k] > best) { best = b->hist[k]; nominal = k; }
+    }
+    lossPct = total ? 100.0 * b->dropped / total : 0.0;
+    jitPct = b->frames ? 100.0 * b->jittered / b->frames : 0.0;
+    printf("  %03X %12ld %8ld %6.2f %7ld %5.1f",
+	   b->id, b->frames, b->dropped, lossPct, nominal, jitPct);
+    if (! b->hist) {
+      printf("     -     -     -       -       -\n");
+      continue;
+    }
+    extra = histPct(b->hist, 1) - nominal;
+    printf(" %5ld %5ld %5ld %7.2f %+7ld\n",
+	   histPct(b->hist, 0.5), histPct(b->hist, 0.99),
+	   histPct(b->hist, 1), histMean(b->hist), extra);
+
+    /* What beacon's settings should produce.  It drops a frame when
+     * rand() % 100 <= L, i.e. (L+1)% of the time; a jittered frame
+     * is delayed by (rand() % 100) * period * T / 10000 ms, which
+     * is only visible (marked "++") when that comes to 1ms or more;
+     * and its 1/2ms polling adds up to 1ms to any frame. */
+    expLoss = loss ? loss + 1 : 0;
+    for (k = 0, r = 0; r < 100; r++)
+      if ((r * nominal * timing) / 10000 > 0) k++;
+    expJit = jitter * k / 100.0;
+    maxExtra = (99 * nominal * timing) / 10000 + 1;
+    printf("       expected  %6.2f         %5.1f   max extra %ld ms",
+	   expLoss, expJit, maxExtra);
+    if (! pctOk(lossPct, expLoss, total) || ! pctOk(jitPct, expJit, b->frames)
+	|| extra > maxExtra) {
+      printf("  ** OUT OF BOUNDS:%s%s%s",
+	     pctOk(lossPct, expLoss, total) ? "" : " loss",
+	     pctOk(jitPct, expJit, b->frames) ? "" : " jitter",
+	     (extra > maxExtra) ? " delay" : "");
+    }
+    printf("\n");
+  }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+int main(int argc, char *argv[]) {
+  int opt, i;
+
+  while ((opt = getopt(argc, argv, "ht:p:T:J:L:w:")) >= 0) {
+    switch (opt) {
+    case 't':
+      nthreads = atoi(optarg);
+      break;
+    case 'p':
+      period = atoi(optarg);
+      break;
+    case 'T':
+      timing = atoi(optarg);
+      break;
+    case 'J':
+      jitter = atoi(optarg);
+      break;
+    case 'L':
+      loss = atoi(optarg);
+      break;
+    case 'w':
+      window = atoi(optarg);
+      break;
+    case 'h':
+      printf(USAGE, argv[0]);
+      printf(HELP);
+      return(0);
+    default:  /* '?' */
+      fprintf(stderr, USAGE, argv[0]);
+      return(1);
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, USAGE, argv[0]);
+    return(1);
+  }
+  if (nthreads < 1) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads < 1) nthreads = 1;
+
+  for (i = optind; i < argc; i++)
+    if (analyzeFile(argv[i]) < 0) return(2);
+
+  printf("\n%ld lines analyzed.\n", linesTotal);
+  reportServices();
+  reportBeacon();
+  return(0);
+
+} /* main() */
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
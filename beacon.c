@@ -1,6 +1,8 @@
 /* beacon.c - Issue periodic messages on CAN (using socketcan)             */
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#define _GNU_SOURCE             /* for sendmmsg() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -8,6 +10,11 @@
 #include <time.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <math.h>
+#include <ctype.h>
+#include <stdint.h>
+
+#include <poll.h>
 
 #include <net/if.h>
 #include <sys/types.h>
@@ -16,11 +23,13 @@
 
 #include <linux/can.h>
 #include <linux/raw.h>
+#include <linux/net_tstamp.h>
 
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 #define USAGE "\
-Usage: %s [-i <id>] [-p <ms>] [-s] [-d] [<iface>]\n"
+Usage: %s [-i <id>] [-p <ms>] [-s] [-d] [-f <dbc> [-g <sig>=<gen>]]\n\
+          [-m <id>[,<id>...] [-r <s>]] [-B <n> [-E]] [<iface>]\n"
 #define HELP "\n\
 Sends a periodic CAN frame to the specified interface.\n\
 \n\
@@ -36,6 +45,43 @@ Options:\n\
 <iface> Specifies the CAN socket interface name to use,\n\
         default is vcan0.\n\
 \n\
+DBC Options:\n\
+-f <f>  Loads the DBC file <f> and sends every message it defines,\n\
+        each at its GenMsgCycleTime (or -p if it has none), with\n\
+        the payload packed from generated signal values.  The -i\n\
+        and -s options are ignored.\n\
+-g <s>=<gen>[:<ms>]\n\
+        Selects the generator for signal <s>; may be repeated.\n\
+        <gen> is one of const, ramp, sine, walk, counter or crc,\n\
+        <ms> is the ramp/sine period (default 10000).  By default\n\
+        signals named like *CRC*/*Chks* get an AUTOSAR E2E Profile 1\n\
+        CRC, *Counter*/*Alive* (or a \"Cnt\" word or suffix) a\n\
+        rolling counter, and all others a ramp between their\n\
+        minimum and maximum.\n\
+\n\
+Monitor Options:\n\
+-m <ids> Instead of sending, receives the comma-separated list of\n\
+        CAN ids and reports their inter-arrival times, taken from\n\
+        kernel receive timestamps, and frame losses.  The expected\n\
+        period is -p, or the cycle time when -f is also given.  A\n\
+        gap of N periods counts as N-1 lost frames, so large -T\n\
+        values on the sender also show up as loss.  The wakeup\n\
+        latency (kernel timestamp to user space) is reported too.\n\
+-r <s>  Sets the monitor report interval in seconds, default 10.\n\
+\n\
+Batched Transmit Options:\n\
+-B <n>  Plans the next <n> frames (of all messages) ahead of time\n\
+        and sends them together with sendmmsg().  Frames are then\n\
+        due at exact multiples of the period (plus jitter) rather\n\
+        than whenever the send loop notices.  Without -E the frames\n\
+        are released by sleeping until each deadline (use this on\n\
+        vcan).\n\
+-E      With -B, hands each frame's deadline to the kernel as an\n\
+        SO_TXTIME launch time, so beacon only wakes once per batch.\n\
+        Needs CAP_NET_ADMIN and an ETF qdisc on the interface, e.g.\n\
+          tc qdisc replace dev can0 root etf clockid CLOCK_TAI \\\n\
+             delta 200000\n\
+\n\
 Jitter and Frame Loss Options:\n\
 -T <v>  Sets the timing jitter.  The default is zero, meaning\n\
         no additional jitter added. The maximum value is 200,\n\
@@ -46,6 +92,767 @@ Jitter and Frame Loss Options:\n\
 \n\
 "
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* DBC-driven traffic.  Each signal's bit layout is compiled once into
+ * a pack plan -- one (byte, shift, mask) step per payload byte the
+ * signal touches -- so building a payload is just a few shifts and
+ * ORs per signal, whatever the byte order of the signal. */
+
+#define MAXMSGS  2048
+#define MAXSIGS  16384
+#define MAXGENS  64
+
+enum { GEN_CONST, GEN_RAMP, GEN_SINE, GEN_WALK, GEN_COUNTER, GEN_CRC };
+const char *genNames[] = { "const", "ramp", "sine", "walk", "counter", "crc" };
+
+struct packop {
+  unsigned char byte;       /* payload byte index            */
+  signed char shift;        /* raw >> shift (<< if negative) */
+  unsigned char mask;       /* bits of the byte owned        */
+};
+
+struct signal {
+  char name[64];
+  int length;               /* bits                          */
+  int issigned;
+  double factor, offset;    /* phys = raw * factor + offset  */
+  double min, max;          /* physical range                */
+  double rawlo, rawhi;      /* raw range                     */
+  int gen;                  /* generator (GEN_*)             */
+  double gperiod;           /* ramp/sine period (ms)         */
+  double value;             /* current value (walk/counter)  */
+  int nops;
+  struct packop op[8];
+};
+
+struct message {
+  canid_t id;
+  int dlc;
+  int period;               /* ms                            */
+  long lastSent;
+  long tjitter;
+  int first, nsig;          /* signals, in the sigs[] pool   */
+  int crcsig;               /* E2E CRC signal, or -1         */
+  int stamp;                /* payload is the send time (ms) */
+  long long due;            /* next deadline (ns), batch mode */
+  struct can_frame frame;
+};
+
+struct message msgs[MAXMSGS];
+struct signal sigs[MAXSIGS];
+int nmsgs = 0;
+int nsigs = 0;
+
+/* Generator overrides from the command line (-g) */
+char *genOpts[MAXGENS];
+int ngenOpts = 0;
+
+/* CRC-8 SAE J1850 (polynomial 0x1D), as used by AUTOSAR E2E Profile 1 */
+unsigned char crc8Table[256];
+
+void crc8Init(void) {
+  int i, k;
+  unsigned char c;
+  for (i = 0; i < 256; i++) {
+    c = i;
+    for (k = 0; k < 8; k++) c = (c & 0x80) ? ((c << 1) ^ 0x1D) : (c << 1);
+    crc8Table[i] = c;
+  }
+}
+
+/* Case-insensitive substring test, for the default generator choice */
+int nameHas(const char *name, const char *what) {
+  int i, n = strlen(what);
+  for (; *name; name++) {
+    for (i = 0; i < n && tolower(name[i]) == tolower(what[i]); i++);
+    if (i == n) return 1;
+  }
+  return 0;
+}
+
+/* As nameHas(), but only matching 'what' as a suffix of the name or
+ * a whole word of it, delimited by '_', digits, the ends of the name
+ * or a change from lower to upper case.  So "MSGCNT", "MsgCnt" and
+ * "ALIVE_CNT_2" have "cnt", "EngCntrlMode" does not. */
+int nameWord(const char *name, const char *what) {
+  int i, n = strlen(what);
+  const char *p;
+  for (p = name; *p; p++) {
+    for (i = 0; i < n && tolower(p[i]) == tolower(what[i]); i++);
+    if (i < n) continue;
+    if (! p[n]) return 1;
+    if (p > name && isalpha(p[-1]) &&
+	! (islower(p[-1]) && isupper(p[0]))) continue;
+    if (isalpha(p[n]) && ! (islower(p[n-1]) && isupper(p[n]))) continue;
+    return 1;
+  }
+  return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Compile the bit layout of a signal into its pack plan.  'start' is
+ * the DBC start bit: the LSB for Intel signals, the MSB for Motorola
+ * ones.  Returns -1 if the signal does not fit in 'dlc' bytes. */
+
+int compileSignal(struct signal *sg, int start, int intel, int dlc) {
+  int k, pos, byte, bit, shift;
+  sg->nops = 0;
+  for (k = 0; k < sg->length; k++) {
+    if (intel) {
+      pos = start + k;
+    } else {
+      /* Walk down from the MSB in DBC "sawtooth" bit numbering */
+      int steps = sg->length - 1 - k;
+      pos = start;
+      while (steps-- > 0) pos = (pos % 8 == 0) ? pos + 15 : pos - 1;
+    }
+    byte = pos / 8;
+    bit = pos % 8;
+    if (byte >= dlc) return -1;
+    shift = k - bit;
+    if (sg->nops && sg->op[sg->nops - 1].byte == byte) {
+      sg->op[sg->nops - 1].mask |= 1 << bit;
+    } else {
+      if (sg->nops == 8) return -1;
+      sg->op[sg->nops].byte = byte;
+      sg->op[sg->nops].shift = shift;
+      sg->op[sg->nops].mask = 1 << bit;
+      sg->nops++;
+    }
+  }
+  return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Load messages and signals from a DBC file.  Only the BO_, SG_ and
+ * BA_ "GenMsgCycleTime" entries are used; multiplexed signals (m<n>)
+ * and messages longer than 8 bytes are skipped. */
+
+int loadDbc(const char *fname, int period) {
+  FILE *fp;
+  char line[1024], name[64], mux[16];
+  struct message *m = NULL;
+  unsigned long id;
+  int i, n, dlc, cycle;
+
+  if ((fp = fopen(fname, "r")) == NULL) {
+    perror("Error opening DBC file");
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), fp)) {
+    char *p = line;
+    while (isspace(*p)) p++;
+
+    if (sscanf(p, "BO_ %lu %63[^:]: %d", &id, name, &dlc) == 3) {
+      m = NULL;
+      if (dlc < 0 || dlc > 8 || nmsgs == MAXMSGS) continue;
+      m = &msgs[nmsgs++];
+      memset(m, 0, sizeof(*m));
+      if (id & 0x80000000UL) m->id = (id & CAN_EFF_MASK) | CAN_EFF_FLAG;
+      else m->id = id & CAN_SFF_MASK;
+      m->dlc = dlc;
+      m->period = period;
+      m->first = nsigs;
+      m->crcsig = -1;
+      m->frame.can_id = m->id;
+      m->frame.can_dlc = dlc;
+
+    } else if (m && sscanf(p, "SG_ %63s %n", name, &n) == 1) {
+      struct signal *sg = &sigs[nsigs];
+      int start, len, intel;
+      char order, sign;
+      p += n;
+      if (*p != ':') {
+	if (sscanf(p, "%15s %n", mux, &n) != 1) continue;
+	if (mux[0] == 'm' && mux[1] != '\0') continue;  /* multiplexed */
+	p += n;
+      }
+      if (nsigs == MAXSIGS) continue;
+      memset(sg, 0, sizeof(*sg));
+      if (sscanf(p, ": %d|%d@%c%c (%lf,%lf) [%lf|%lf]", &start, &len,
+		 &order, &sign, &sg->factor, &sg->offset,
+		 &sg->min, &sg->max) != 8) continue;
+      if (len < 1 || len > 64 || sg->factor == 0) continue;
+      strcpy(sg->name, name);
+      sg->length = len;
+      sg->issigned = (sign == '-');
+      intel = (order == '1');
+      if (compileSignal(sg, start, intel, dlc) < 0) {
+	fprintf(stderr, "Warning: signal %s does not fit, ignored\n", name);
+	continue;
+      }
+      sg->rawlo = sg->issigned ? -ldexp(1, len - 1) : 0;
+      sg->rawhi = sg->issigned ? ldexp(1, len - 1) - 1 : ldexp(1, len) - 1;
+      if (sg->min >= sg->max) {
+	/* No usable range in the DBC, use the raw range */
+	sg->min = sg->rawlo * sg->factor + sg->offset;
+	sg->max = sg->rawhi * sg->factor + sg->offset;
+	if (sg->min > sg->max) { double t = sg->min; sg->min = sg->max; sg->max = t; }
+      }
+      if (nameHas(name, "crc") || nameHas(name, "chks") ||
+	  nameHas(name, "checksum")) sg->gen = GEN_CRC;
+      else if (nameHas(name, "counter") || nameWord(name, "cnt") ||
+	       nameHas(name, "alive")) sg->gen = GEN_COUNTER;
+      else sg->gen = GEN_RAMP;
+      sg->gperiod = 10000;
+      sg->value = sg->min;
+      nsigs++;
+      m->nsig++;
+
+    } else if (sscanf(p, "BA_ \"GenMsgCycleTime\" BO_ %lu %d", &id, &cycle) == 2) {
+      for (i = 0; i < nmsgs; i++) {
+	canid_t cid = (id & 0x80000000UL) ?
+	  ((id & CAN_EFF_MASK) | CAN_EFF_FLAG) : (id & CAN_SFF_MASK);
+	if (msgs[i].id == cid && cycle > 0) msgs[i].period = cycle;
+      }
+    }
+  }
+  fclose(fp);
+
+  /* Apply generator overrides, then locate each message's CRC signal */
+  for (i = 0; i < ngenOpts; i++) {
+    char *eq = strchr(genOpts[i], '=');
+    int g, k, hit = 0;
+    if (! eq) continue;
+    for (g = 0; g <= GEN_CRC; g++)
+      if (! strncmp(eq + 1, genNames[g], strlen(genNames[g]))) break;
+    if (g > GEN_CRC) {
+      fprintf(stderr, "Error: unknown generator: \"%s\"\n", eq + 1);
+      return -1;
+    }
+    for (k = 0; k < nsigs; k++) {
+      if (strlen(sigs[k].name) != (size_t)(eq - genOpts[i]) ||
+	  strncmp(sigs[k].name, genOpts[i], eq - genOpts[i])) continue;
+      sigs[k].gen = g;
+      if (strchr(eq, ':')) sigs[k].gperiod = atoi(strchr(eq, ':') + 1);
+      if (sigs[k].gperiod < 1) sigs[k].gperiod = 1;
+      hit++;
+    }
+    if (! hit) fprintf(stderr, "Warning: no signal \"%.*s\" in DBC\n",
+		       (int)(eq - genOpts[i]), genOpts[i]);
+  }
+  for (i = 0; i < nmsgs; i++) {
+    for (n = msgs[i].first; n < msgs[i].first + msgs[i].nsig; n++) {
+      struct signal *sg = &sigs[n];
+      if (sg->gen != GEN_CRC) continue;
+      if (sg->length == 8 && sg->nops == 1 && sg->op[0].mask == 0xff) {
+	msgs[i].crcsig = n;
+      } else {
+	fprintf(stderr, "Warning: CRC signal %s is not a whole byte\n",
+		sg->name);
+	sg->gen = GEN_CONST;
+      }
+    }
+  }
+
+  return nmsgs;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Produce the next raw value of a signal at time 'tnow' (ms) */
+
+uint64_t nextRaw(struct signal *sg, long tnow) {
+  double phys, raw, span = sg->max - sg->min;
+
+  switch (sg->gen) {
+  case GEN_RAMP:
+    phys = sg->min + span * fmod(tnow, sg->gperiod) / sg->gperiod;
+    break;
+  case GEN_SINE:
+    phys = sg->min + span * (0.5 + 0.5 * sin(2 * M_PI * tnow / sg->gperiod));
+    break;
+  case GEN_WALK:
+    sg->value += span * ((double)rand() / RAND_MAX - 0.5) / 50;
+    if (sg->value < sg->min) sg->value = sg->min;
+    if (sg->value > sg->max) sg->value = sg->max;
+    phys = sg->value;
+    break;
+  case GEN_COUNTER:
+    /* Counters step in raw units and wrap past the DBC maximum */
+    phys = sg->value;
+    sg->value += sg->factor;
+    if (sg->value > sg->max + sg->factor / 2) sg->value = sg->min;
+    break;
+  default:
+    phys = sg->min;
+    break;
+  }
+
+  raw = nearbyint((phys - sg->offset) / sg->factor);
+  if (raw < sg->rawlo) raw = sg->rawlo;
+  if (raw > sg->rawhi) raw = sg->rawhi;
+  return (raw < 0) ? (uint64_t)(int64_t)raw : (uint64_t)raw;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Build the payload of a message by running its signals' pack plans,
+ * then fill in the E2E Profile 1 CRC (over the data id -- the low
+ * 16 bits of the CAN id -- and all other payload bytes). */
+
+void packMessage(struct message *m, long tnow) {
+  uint64_t raw, v;
+  unsigned char *d = m->frame.data;
+  int i, k;
+
+  memset(d, 0, 8);
+  for (i = m->first; i < m->first + m->nsig; i++) {
+    struct signal *sg = &sigs[i];
+    if (sg->gen == GEN_CRC) continue;
+    raw = nextRaw(sg, tnow);
+    for (k = 0; k < sg->nops; k++) {
+      struct packop *op = &sg->op[k];
+      v = (op->shift >= 0) ? (raw >> op->shift) : (raw << -op->shift);
+      d[op->byte] |= v & op->mask;
+    }
+  }
+
+  if (m->crcsig >= 0) {
+    /* Profile 1 chains Crc_CalculateCRC8() with a compensating XOR,
+     * so the effective start value and final XOR are both 0x00.
+     * Check: id 0x123 with data 12 34 BC 0A 0A BC FE gives 0x2A. */
+    int at = sigs[m->crcsig].op[0].byte;
+    unsigned char crc = 0x00;
+    crc = crc8Table[crc ^ (m->id & 0xff)];
+    crc = crc8Table[crc ^ ((m->id >> 8) & 0xff)];
+    for (i = 0; i < m->dlc; i++) if (i != at) crc = crc8Table[crc ^ d[i]];
+    d[at] = crc;
+  }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Monitor mode.  Each monitored id keeps fixed-size histograms which
+ * are printed and cleared every report interval, so memory use does
+ * not grow however long the monitor runs. */
+
+#define MAXMON  64
+#define MONBINS 200           /* inter-arrival bins, period/50 wide   */
+#define LATBINS 24            /* wakeup latency bins, powers of 2 us  */
+
+struct monid {
+  canid_t id;
+  long period;                /* expected period (us)          */
+  long long last;             /* kernel timestamp of last (ns) */
+  long frames, lost, gaps;    /* this interval                 */
+  long tframes, tlost;        /* since start                   */
+  double sum, sumsq, min, max;/* inter-arrival (us)            */
+  long hist[MONBINS + 1];
+  long lat[LATBINS];
+  long latmax;
+};
+
+struct monid mons[MAXMON];
+int nmons = 0;
+
+/* Parse the -m list of ids */
+int monitorIds(char *list) {
+  char *p = list, *e;
+  long id;
+  while (*p) {
+    id = strtol(p, &e, 0);
+    if (e == p || id < 1 || id > CAN_EFF_MASK || nmons == MAXMON) return -1;
+    memset(&mons[nmons], 0, sizeof(mons[0]));
+    mons[nmons++].id = (id > CAN_SFF_MASK) ? (id | CAN_EFF_FLAG) : id;
+    p = e;
+    if (*p == ',') p++;
+    else if (*p) return -1;
+  }
+  return nmons;
+}
+
+/* Value (us) at fraction 'f' of the inter-arrival histogram */
+double monPct(struct monid *m, double f) {
+  long k = 0;
+  int i;
+  for (i = 0; i <= MONBINS; i++) {
+    k += m->hist[i];
+    if (k >= f * m->gaps) break;
+  }
+  return (i + 0.5) * m->period / 50.0;
+}
+
+/* Print, then clear, the interval statistics of every id */
+void monitorReport(long secs) {
+  int i, k;
+  for (i = 0; i < nmons; i++) {
+    struct monid *m = &mons[i];
+    long n = m->frames + m->lost, tn = m->tframes + m->tlost;
+    long lk = 0;
+    printf("%6ld s  %03X  %ld frames, %ld lost (%.2f%%), total %ld/%ld"
+	   " lost (%.2f%%)\n", secs, m->id & CAN_EFF_MASK, m->frames, m->lost,
+	   n ? 100.0 * m->lost / n : 0.0, m->tlost, tn,
+	   tn ? 100.0 * m->tlost / tn : 0.0);
+    if (m->gaps) {
+      double mean = m->sum / m->gaps;
+      double sd = sqrt(fabs(m->sumsq / m->gaps - mean * mean));
+      printf("          period %.3f ms: min %.3f mean %.3f max %.3f"
+	     " sd %.3f p50 %.3f p99 %s%.3f\n", m->period / 1000.0,
+	     m->min / 1000, mean / 1000, m->max / 1000, sd / 1000,
+	     monPct(m, 0.5) / 1000, (m->hist[MONBINS] > m->gaps / 100) ? ">" : "",
+	     monPct(m, 0.99) / 1000);
+    }
+    if (m->frames) {
+      for (k = 0; k < LATBINS && lk < 0.99 * m->frames; k++) lk += m->lat[k];
+      printf("          wakeup latency: p99 < %ld us, max %ld us\n",
+	     1L << (k - 1), m->latmax);
+    }
+    m->frames = m->lost = m->gaps = 0;
+    m->sum = m->sumsq = m->max = 0;
+    m->min = 1e18;
+    m->latmax = 0;
+    memset(m->hist, 0, sizeof(m->hist));
+    memset(m->lat, 0, sizeof(m->lat));
+  }
+  fflush(stdout);
+}
+
+/* Account for one received frame */
+void monitorFrame(struct monid *m, long long kts, long long uts) {
+  long lat = (uts - kts) / 1000;
+  int k;
+
+  if (m->last) {
+    double gap = (kts - m->last) / 1000.0;
+    long missed = (long)((gap + m->period / 2) / m->period) - 1;
+    if (missed > 0) {
+      m->lost += missed;
+      m->tlost += missed;
+    }
+    k = gap * 50 / m->period;
+    if (k < 0) k = 0;
+    if (k > MONBINS) k = MONBINS;
+    m->hist[k]++;
+    m->gaps++;
+    m->sum += gap;
+    m->sumsq += gap * gap;
+    if (gap < m->min) m->min = gap;
+    if (gap > m->max) m->max = gap;
+  }
+  m->last = kts;
+  m->frames++;
+  m->tframes++;
+
+  if (lat < 0) lat = 0;
+  for (k = 0; k < LATBINS - 1 && (1L << k) <= lat; k++);
+  m->lat[k]++;
+  if (lat > m->latmax) m->latmax = lat;
+}
+
+/* Receive loop for monitor mode */
+int monitor(int sock, int period, int interval) {
+  struct can_filter filter[MAXMON];
+  struct can_frame f;
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  struct timespec ts, *kts;
+  char ctrl[CMSG_SPACE(sizeof(struct timespec))];
+  struct pollfd pfd;
+  long long now, start, next;
+  int i, k, n, on = 1;
+
+  for (i = 0; i < nmons; i++) {
+    filter[i].can_id = mons[i].id;
+    filter[i].can_mask = (mons[i].id & CAN_EFF_FLAG) ?
+      (CAN_EFF_MASK | CAN_EFF_FLAG) : (CAN_SFF_MASK | CAN_EFF_FLAG);
+    mons[i].period = period * 1000L;
+    for (k = 0; k < nmsgs; k++)
+      if (msgs[k].id == mons[i].id) mons[i].period = msgs[k].period * 1000L;
+    if (mons[i].period < 1000) {
+      /* Gaps are measured in periods, so this would divide by zero */
+      fprintf(stderr, "Error: invalid period %ld for id 0x%03X\n",
+	      mons[i].period / 1000, mons[i].id);
+      return 1;
+    }
+    mons[i].min = 1e18;
+  }
+  if (setsockopt(sock, SOL_CAN_RAW, CAN_RAW_FILTER, filter,
+		 nmons * sizeof(struct can_filter)) < 0) {
+    perror("Error setting CAN filter");
+    return 4;
+  }
+  if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0) {
+    perror("Error enabling receive timestamps");
+    return 4;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  start = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  next = start + interval * 1000000000LL;
+  pfd.fd = sock;
+  pfd.events = POLLIN;
+
+  while (1) {
+    clock_gettime(CLOCK_REALTIME, &ts);
+    now = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    if (now >= next) {
+      monitorReport((next - start) / 1000000000LL);
+      next += interval * 1000000000LL;
+      continue;
+    }
+    if (poll(&pfd, 1, (next - now) / 1000000 + 1) <= 0) continue;
+
+    /* Drain everything that is queued */
+    while (1) {
+      iov.iov_base = &f;
+      iov.iov_len = sizeof(f);
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = ctrl;
+      msg.msg_controllen = sizeof(ctrl);
+      if ((n = recvmsg(sock, &msg, MSG_DONTWAIT)) < 0) break;
+      if (n < (int)sizeof(f)) continue;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      now = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+      kts = NULL;
+      for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+	if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS)
+	  kts = (struct timespec *)CMSG_DATA(cm);
+      for (i = 0; i < nmons && mons[i].id != f.can_id; i++);
+      if (i == nmons) continue;
+      monitorFrame(&mons[i], kts ? kts->tv_sec * 1000000000LL + kts->tv_nsec
+		   : now, now);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      perror("recvmsg(): Error receiving CAN frame");
+      return 3;
+    }
+  }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Send a frame - retry if necessary.  Returns bytes written, or -1
+ * on an unrecoverable error. */
+
+int sendFrame(int sock, struct can_frame *f) {
+  int i = 3, n = -1;
+  while (i > 0) {
+    n = write(sock, f, sizeof(struct can_frame));
+    if (n < 0) {
+      if ((errno != ENETDOWN) || (i == 0)) {
+	perror("write(): Error sending CAN frame");
+	return -1;
+      } else {
+	i--;
+	usleep(500);
+      }
+    } else {
+      i = 0;
+    }
+  }
+  return n;
+}
+
+/* Randomly pick the extra delay (ms) before the next frame: 'jitter'
+ * percent of frames are delayed by up to 'timing' percent of period */
+
+long pickJitter(int jitter, int timing, int period) {
+  if (jitter && ((rand() % 100) < jitter))
+    return ((rand() % 100) * period * timing) / 10000;
+  return 0;
+}
+
+/* Print out a tx frame we just sent (or dropped) */
+
+void printFrame(long tnow, long lastSent, long tjitter,
+		struct can_frame *f, int dropped) {
+  int i;
+  if (dropped) {
+    printf("%5d.%03d %5d+   *** frame dropped ***  %03X\n",
+	   (tnow / 1000), (tnow % 1000), tnow - lastSent, f->can_id);
+    return;
+  }
+  printf("%5d.%03d %5d+%s  %03X  [%d]",
+	 (tnow / 1000), (tnow % 1000), tnow - lastSent,
+	 (tjitter)?"+":" ", f->can_id, f->can_dlc);
+  for (i=0;i<f->can_dlc;i++) printf(" %02X", f->data[i]);
+  printf("\n");
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Batched transmit mode.  Upcoming frames are taken from a heap of
+ * messages ordered by deadline, packed, and sent in one sendmmsg()
+ * call, either each with an SO_TXTIME launch time for the ETF qdisc,
+ * or released by sleeping until their (absolute) deadline. */
+
+#define MAXBATCH 256
+#define LEAD_NS  2000000LL    /* wake this early for an ETF batch */
+
+int heap[MAXMSGS];            /* message indices, earliest first */
+int nheap = 0;
+
+void heapDown(int i) {
+  int c, t;
+  while ((c = 2 * i + 1) < nheap) {
+    if (c + 1 < nheap && msgs[heap[c + 1]].due < msgs[heap[c]].due) c++;
+    if (msgs[heap[i]].due <= msgs[heap[c]].due) break;
+    t = heap[i]; heap[i] = heap[c]; heap[c] = t;
+    i = c;
+  }
+}
+
+long long nowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_TAI, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void sleepUntil(long long t) {
+  struct timespec ts;
+  ts.tv_sec = t / 1000000000LL;
+  ts.tv_nsec = t % 1000000000LL;
+  while (clock_nanosleep(CLOCK_TAI, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+/* Send frames.  If the socket buffer is full, wait for space; if
+ * the device queue is full (ENOBUFS, which poll() cannot see), back
+ * off for 100us, doubling up to 2ms while it stays full.  As for
+ * unbatched frames, ENETDOWN is retried every 1/2 ms, and a frame
+ * is given up on after 3 tries.  Returns -1 on an unrecoverable
+ * error. */
+
+#define BACKOFF_NS    100000L
+#define BACKOFF_MAXNS 2000000L
+
+int sendBatch(int sock, struct mmsghdr *v, int n) {
+  struct pollfd pfd;
+  struct timespec ts;
+  long backoff = BACKOFF_NS;
+  int k, done = 0, down = 3;
+  pfd.fd = sock;
+  pfd.events = POLLOUT;
+  while (done < n) {
+    if ((k = sendmmsg(sock, v + done, n - done, 0)) >= 0) {
+      done += k;
+      backoff = BACKOFF_NS;
+      down = 3;
+    } else if (errno == EAGAIN || errno == EINTR) {
+      poll(&pfd, 1, 1);
+    } else if (errno == ENOBUFS) {
+      ts.tv_sec = 0;
+      ts.tv_nsec = backoff;
+      nanosleep(&ts, NULL);
+      if (backoff < BACKOFF_MAXNS) backoff *= 2;
+    } else if (errno == ENETDOWN) {
+      if (--down > 0) {
+	usleep(500);
+      } else {
+	done++;
+	down = 3;
+      }
+    } else {
+      perror("sendmmsg(): Error sending CAN frames");
+      return -1;
+    }
+  }
+  return done;
+}
+
+int batchLoop(int sock, int batch, int etf, int debug,
+	      int loss, int jitter, int timing) {
+  static struct can_frame frames[MAXBATCH];
+  static struct mmsghdr v[MAXBATCH];
+  static struct iovec iov[MAXBATCH];
+  static char ctrl[MAXBATCH][CMSG_SPACE(sizeof(uint64_t))];
+  long long due[MAXBATCH];
+  long long base, now;
+  struct cmsghdr *cm;
+  int i, k, n;
+
+  /* An empty table or a zero period would spin, flooding the bus */
+  if (nmsgs == 0) {
+    fprintf(stderr, "Error: no messages to send\n");
+    return 1;
+  }
+  for (i = 0; i < nmsgs; i++) {
+    if (msgs[i].period < 1) {
+      fprintf(stderr, "Error: invalid period %d for id 0x%03X\n",
+	      msgs[i].period, msgs[i].id);
+      return 1;
+    }
+  }
+
+  if (etf) {
+    struct sock_txtime st;
+    st.clockid = CLOCK_TAI;
+    st.flags = 0;
+    if (setsockopt(sock, SOL_SOCKET, SO_TXTIME, &st, sizeof(st)) < 0) {
+      perror("Warning: SO_TXTIME unavailable, sleeping until deadlines");
+      etf = 0;
+    }
+  }
+
+  base = nowNs() + LEAD_NS;
+  for (i = 0; i < nmsgs; i++) {
+    msgs[i].due = base + (msgs[i].lastSent + msgs[i].period) * 1000000LL;
+    heap[nheap++] = i;
+  }
+  for (i = nheap / 2; i >= 0; i--) heapDown(i);
+
+  while (1) {
+
+    /* Plan the next batch of frames */
+    now = nowNs();
+    for (n = 0; n < batch; ) {
+      struct message *m = &msgs[heap[0]];
+      long tnow;
+      if (etf && m->due < now + LEAD_NS / 2) {
+	/* Too late for the qdisc; restart this message from now */
+	if (debug) printf("          %03X  late by %lld us\n",
+			  m->id, (now - m->due) / 1000);
+	m->due = now + LEAD_NS;
+      }
+      tnow = (m->due - base) / 1000000;
+      if (! loss || ((rand() % 100) > loss)) {
+	if (m->stamp) memcpy(m->frame.data, &tnow, 8);
+	else if (m->nsig) packMessage(m, tnow);
+	frames[n] = m->frame;
+	due[n++] = m->due;
+	if (debug) printFrame(tnow, m->lastSent, m->tjitter, &m->frame, 0);
+      } else {
+	if (debug) printFrame(tnow, m->lastSent, m->tjitter, &m->frame, 1);
+      }
+      m->lastSent = tnow;
+      m->tjitter = pickJitter(jitter, timing, m->period);
+      m->due += (m->period + m->tjitter) * 1000000LL;
+      heapDown(0);
+    }
+
+    for (i = 0; i < n; i++) {
+      iov[i].iov_base = &frames[i];
+      iov[i].iov_len = sizeof(struct can_frame);
+      memset(&v[i], 0, sizeof(v[i]));
+      v[i].msg_hdr.msg_iov = &iov[i];
+      v[i].msg_hdr.msg_iovlen = 1;
+      if (etf) {
+	v[i].msg_hdr.msg_control = ctrl[i];
+	v[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
+	cm = CMSG_FIRSTHDR(&v[i].msg_hdr);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_TXTIME;
+	cm->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+	memcpy(CMSG_DATA(cm), &due[i], sizeof(uint64_t));
+      }
+    }
+
+    if (etf) {
+      /* One wakeup per batch, the kernel does the rest */
+      if (n) sleepUntil(due[0] - LEAD_NS);
+      if (sendBatch(sock, v, n) < 0) return 3;
+    } else {
+      /* Release each group of frames that share a deadline */
+      for (i = 0; i < n; i = k) {
+	sleepUntil(due[i]);
+	for (k = i + 1; k < n && due[k] <= due[i]; k++);
+	if (sendBatch(sock, v + i, k - i) < 0) return 3;
+      }
+    }
+    if (debug > 2) printf("DEBUG: sendmmsg(): sent %d frames\n", n);
+
+  } /* while (1) */
+}
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 int main(int argc, char *argv[]) {
@@ -71,7 +878,12 @@ int main(int argc, char *argv[]) {
   int jitter = 0;         /* Pct frames affected by jitter */
   int loss = 0;           /* Frame loss percentage */
 
-  while ((opt = getopt(argc, argv, "sdhp:i:T:J:L:S:")) >= 0) {
+  char *dbcfile = NULL;   /* DBC file describing the traffic */
+  int interval = 10;      /* Monitor report interval (s) */
+  int batch = 0;          /* Frames per batch, 0 = unbatched */
+  int etf = 0;            /* Use kernel launch times (ETF) */
+
+  while ((opt = getopt(argc, argv, "sdhEp:i:T:J:L:S:f:g:m:r:B:")) >= 0) {
     switch (opt) {
     case 'd':
       debug++;
@@ -117,6 +929,39 @@ int main(int argc, char *argv[]) {
     case 'S':
       seed = strtol(optarg, NULL, 0);
       break;
+    case 'f':
+      dbcfile = optarg;
+      break;
+    case 'g':
+      if (ngenOpts == MAXGENS || ! strchr(optarg, '=')) {
+	fprintf(stderr, "Error: invalid generator: \"%s\"\n", optarg);
+	return(1);
+      }
+      genOpts[ngenOpts++] = optarg;
+      break;
+    case 'm':
+      if (monitorIds(optarg) < 1) {
+	fprintf(stderr, "Error: invalid CAN id list: \"%s\"\n", optarg);
+	return(1);
+      }
+      break;
+    case 'B':
+      batch = atoi(optarg);
+      if (batch < 1 || batch > MAXBATCH) {
+	fprintf(stderr, "Error: invalid batch size: \"%s\"\n", optarg);
+	return(1);
+      }
+      break;
+    case 'E':
+      etf = 1;
+      break;
+    case 'r':
+      interval = atoi(optarg);
+      if (interval < 1) {
+	fprintf(stderr, "Error: invalid interval: \"%s\"\n", optarg);
+	return(1);
+      }
+      break;
 
     default:  /* '?' */
       fprintf(stderr, USAGE, argv[0]);
@@ -125,20 +970,53 @@ int main(int argc, char *argv[]) {
   }
   if (optind < argc) ifname = argv[optind];
 
-  printf("Sending %s frames to id 0x%03X every %d milliseconds\n",
-	 (fixed)?"fixed":"different", can_id, period);
+  /* Launch times are only set on batched frames */
+  if (etf && ! batch) {
+    fprintf(stderr, "Error: -E requires -B\n");
+    return(1);
+  }
+
+  /* DBC start times are staggered by rand() % period */
+  if (dbcfile && period < 1) {
+    fprintf(stderr, "Error: invalid period: %d\n", period);
+    return(1);
+  }
+
+  if (dbcfile) {
+    crc8Init();
+    if (loadDbc(dbcfile, period) < 0) return(1);
+    if (nmsgs == 0 && ! nmons) {
+      fprintf(stderr, "Error: no usable messages in \"%s\"\n", dbcfile);
+      return(1);
+    }
+  }
+
+  if (nmons) {
+    printf("Monitoring %d id(s), reporting every %d seconds\n",
+	   nmons, interval);
+  } else if (dbcfile) {
+    printf("Sending %d messages (%d signals) from \"%s\"\n",
+	   nmsgs, nsigs, dbcfile);
+  } else {
+    printf("Sending %s frames to id 0x%03X every %d milliseconds\n",
+	   (fixed)?"fixed":"different", can_id, period);
+  }
   printf(" over CAN-bus socket \"%s\" (debug level %d)...\n",
 	 ifname, debug);
-  if (loss) printf(" Frame loss percentage is %d.\n", loss);
-  if (jitter)
+  if (loss && ! nmons) printf(" Frame loss percentage is %d.\n", loss);
+  if (jitter && ! nmons)
     printf(" Jitter up to 1.%dx will affect %d percent of frames.\n",
 	   timing, jitter);
-  if (jitter || loss)
+  if ((jitter || loss) && ! nmons)
     printf(" Random number seed is set to %d.\n", seed);
 
   /* Initialize the random number seed */
   srand(seed);
 
+  /* Spread the first DBC messages over their first period */
+  for (i = 0; i < nmsgs; i++)
+    msgs[i].lastSent = -(rand() % msgs[i].period);
+
   /* Initialize the CAN frame */
   struct can_frame buf;
   buf.can_id  = can_id;
@@ -174,6 +1052,23 @@ int main(int argc, char *argv[]) {
     return 3;
   }
 
+  if (nmons) return monitor(sock, period, interval);
+
+  if (batch) {
+    if (! dbcfile) {
+      /* The single -i message, as a one-entry message table */
+      msgs[0].id = can_id;
+      msgs[0].dlc = 8;
+      msgs[0].period = period;
+      msgs[0].lastSent = -period;
+      msgs[0].crcsig = -1;
+      msgs[0].stamp = ! fixed;
+      msgs[0].frame = buf;
+      nmsgs = 1;
+    }
+    return batchLoop(sock, batch, etf, debug, loss, jitter, timing);
+  }
+
   /* Main loop */
   while (1) {
 
@@ -182,8 +1077,24 @@ int main(int argc, char *argv[]) {
     if (tsbase == 0) tsbase = tspec.tv_sec;
     tnow = ((tspec.tv_sec-tsbase)*1000)+(tspec.tv_nsec/1.0e6);
 
+    /* DBC traffic - check each message in turn */
+    for (i = 0; i < nmsgs; i++) {
+      struct message *m = &msgs[i];
+      if (tnow < (m->lastSent + m->period + m->tjitter)) continue;
+
+      if (! loss || ((rand() % 100) > loss)) {
+	packMessage(m, tnow);
+	if (sendFrame(sock, &m->frame) < 0) return 3;
+	if (debug) printFrame(tnow, m->lastSent, m->tjitter, &m->frame, 0);
+      } else {
+	if (debug) printFrame(tnow, m->lastSent, m->tjitter, &m->frame, 1);
+      }
+      m->lastSent = tnow;
+      m->tjitter = pickJitter(jitter, timing, m->period);
+    }
+
     /* Check if it's time to send a message */
-    if (tnow >= (lastSent + period + tjitter)) {
+    if (! dbcfile && tnow >= (lastSent + period + tjitter)) {
 
       /* Randomly we may choose to simulate message loss... */
       if (! loss || ((rand() % 100) > loss)) {
@@ -192,41 +1103,18 @@ int main(int argc, char *argv[]) {
 	if (! fixed) memcpy(buf.data, &tnow, 8);
 
 	/* Send the message - retry if necessary */
-	i = 3;
-	while (i > 0) {
-	  n = write(sock, &buf, sizeof(struct can_frame));
-	  if (n < 0) {
-	    if ((errno != ENETDOWN) || (i == 0)) {
-	      perror("write(): Error sending CAN frame");
-	      return 3;
-	    } else {
-	      i--;
-	      usleep(500);
-	    }
-	  } else {
-	    i = 0;
-	  }
-	}
+	if ((n = sendFrame(sock, &buf)) < 0) return 3;
 
 	/* TODO: check the number of bytes sent? */
 	if (debug > 2) printf("DEBUG: write(): wrote %d bytes\n", n);
 
 	/* Print out tx buffer we just sent */
-	if (debug) {
-	  printf("%5d.%03d %5d+%s  %03X  [%d]",
-		 (tnow / 1000), (tnow % 1000), tnow - lastSent,
-		 (tjitter)?"+":" ", buf.can_id, buf.can_dlc);
-	  for (i=0;i<buf.can_dlc;i++) printf(" %02X", buf.data[i]);
-	  printf("\n");
-	}
+	if (debug) printFrame(tnow, lastSent, tjitter, &buf, 0);
 
       } else {
 
 	/* Print out the frame lost message */
-	if (debug) {
-	  printf("%5d.%03d %5d+   *** frame dropped ***\n",
-		 (tnow / 1000), (tnow % 1000), tnow - lastSent);
-	}
+	if (debug) printFrame(tnow, lastSent, tjitter, &buf, 1);
 
       }
 
@@ -234,14 +1122,10 @@ int main(int argc, char *argv[]) {
       lastSent = tnow;
 
       /* Randomly, we may add some jitter time... */
-      if (jitter && ((rand() % 100) < jitter)) {
-	tjitter = ((rand() % 100) * period * timing) / 10000;
-	/* Announce jitter, if any */
-	if ((debug > 1) && tjitter) {
-	  printf("          %5d+   jitter\n", tjitter);
-	}
-      } else {
-	tjitter = 0;
+      tjitter = pickJitter(jitter, timing, period);
+      /* Announce jitter, if any */
+      if ((debug > 1) && tjitter) {
+	printf("          %5d+   jitter\n", tjitter);
       }
 
     }
@@ -13,6 +13,8 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <stdint.h>
 
 #include <linux/can.h>
 #include <linux/raw.h>
@@ -52,6 +54,49 @@ int bufflen = 0;
 int buffull = 0;
 uchar buffie[4096];
 
+/* ISO-TP flow control -- block size and separation time advertised
+ * to the tester, plus the count of consecutive frames received since
+ * the last flow-control frame was sent.  Streamed TransferData blocks
+ * are written as they arrive, so they can come at full bus speed. */
+
+int fcBlockSize     = 255;
+int fcSepTime       = 1; /* STmin (ms), buffered messages       */
+int fcStreamSepTime = 0; /* STmin (ms), streamed TransferData   */
+int fcCount     = 0;
+int cfSeq       = 0;
+
+/* Simulated flash memory -- a memory-mapped image file which
+ * RequestDownload/TransferData/RequestTransferExit (0x34/0x36/0x37)
+ * write into.  The address range of the image is 0 .. flashSize-1. */
+
+char *flashFile = "flash.img";
+long  flashSize = 64L * 1024 * 1024;
+uchar *flashMap = NULL;
+
+/* Download (firmware reflash) state */
+
+int      dlActive = 0;   /* RequestDownload accepted          */
+long     dlAddr   = 0;   /* start address of the download     */
+long     dlSize   = 0;   /* total bytes announced             */
+long     dlDone   = 0;   /* bytes written so far              */
+int      dlSeq    = 1;   /* next expected blockSequenceCounter */
+int      dlLast   = -1;  /* last accepted counter, -1 if none  */
+uint32_t dlCrc    = 0;   /* running CRC-32 of the written data */
+
+/* TransferData blocks too large for buffie are streamed straight
+ * into the flash image as each consecutive frame arrives */
+
+int  streaming = 0;      /* current ISO-TP message is streamed */
+int  streamSeq = 0;      /* its blockSequenceCounter           */
+int  streamErr = 0;      /* negative response code, if any     */
+long streamPos = 0;      /* payload bytes consumed so far      */
+long streamDone = 0;     /* dlDone and dlCrc when it began, to  */
+uint32_t streamCrc = 0;  /* undo a block that does not complete */
+
+/* Negative response code slot value for a repeated block, which is
+ * acknowledged again but not written (ISO 14229-1 TransferData) */
+#define NRC_REPEAT (-1)
+
 /* Static transmit buffers */
 
 struct can_frame rtx;
@@ -141,6 +186,169 @@ void doPeriodic() {
   lastSent = tnow;
 }
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* CRC-32 (IEEE 802.3, reflected) used to check downloaded data.  The
+ * table is built on first use; the CRC is updated as each chunk of
+ * a TransferData block lands in the flash image. */
+
+uint32_t crcTable[256];
+
+uint32_t crc32(uint32_t crc, const uchar *p, long n) {
+  static int init = 0;
+  if (! init) {
+    uint32_t c;
+    int i, k;
+    for (i = 0; i < 256; i++) {
+      c = i;
+      for (k = 0; k < 8; k++) c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+      crcTable[i] = c;
+    }
+    init = 1;
+  }
+  crc = ~crc;
+  while (n-- > 0) crc = crcTable[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Map the flash image file, creating it (sparse) if necessary */
+
+int flashOpen(void) {
+  int fd;
+  if (flashMap) return 0;
+  if ((fd = open(flashFile, O_RDWR | O_CREAT, 0644)) < 0) {
+    perror("Error opening flash image");
+    return -1;
+  }
+  if (ftruncate(fd, flashSize) < 0) {
+    perror("Error sizing flash image");
+    close(fd);
+    return -1;
+  }
+  flashMap = mmap(NULL, flashSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (flashMap == MAP_FAILED) {
+    perror("Error mapping flash image");
+    flashMap = NULL;
+    return -1;
+  }
+  if (debug) printf("* Flash image \"%s\" mapped, %ld bytes\n",
+		    flashFile, flashSize);
+  return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Write TransferData payload bytes into the flash image.  Returns a
+ * UDS negative response code, or 0 on success.  Each time another
+ * FLASH_WINDOW bytes have been written, the finished pages are handed
+ * back to the page cache, so the resident size of the simulator stays
+ * flat however large the image being downloaded is. */
+
+#define FLASH_WINDOW (1024L * 1024)
+
+void flashRetire(long from, long to) {
+  long a = from & ~4095L;
+  long b = to & ~4095L;
+  if (b <= a) return;
+  msync(flashMap + a, b - a, MS_ASYNC);
+  madvise(flashMap + a, b - a, MADV_DONTNEED);
+}
+
+int flashWrite(const uchar *p, int n) {
+  long at = dlAddr + dlDone;
+  if (! dlActive) return 0x24;              /* requestSequenceError */
+  if (n > dlSize - dlDone) return 0x71;     /* transferDataSuspended */
+  memcpy(flashMap + at, p, n);
+  dlCrc = crc32(dlCrc, p, n);
+  dlDone += n;
+  if ((at / FLASH_WINDOW) != ((at + n) / FLASH_WINDOW))
+    flashRetire(((at + n) / FLASH_WINDOW - 1) * FLASH_WINDOW,
+		((at + n) / FLASH_WINDOW) * FLASH_WINDOW);
+  return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Begin an ISO-TP message which is a TransferData block too large
+ * to buffer (buffull holds its length) */
+
+void streamStart(void) {
+  streaming = 1;
+  streamPos = 0;
+  streamErr = 0;
+  streamSeq = -1;
+  streamDone = dlDone;
+  streamCrc = dlCrc;
+  if (! dlActive) streamErr = 0x24;         /* requestSequenceError */
+  if (debug) printf("* ISO-TP: streaming %d byte TransferData block\n",
+		    buffull);
+}
+
+/* Consume the next 'n' bytes of a streamed TransferData message */
+
+void streamData(const uchar *p, int n) {
+  /* The service id and block sequence counter lead the payload */
+  while (n > 0 && streamPos < 2) {
+    if (streamPos == 1 && ! streamErr) {
+      streamSeq = *p;
+      if (streamSeq == dlLast) streamErr = NRC_REPEAT;
+      else if (streamSeq != dlSeq) streamErr = 0x73;
+      else if (buffull - 2 > dlSize - dlDone)
+	streamErr = 0x71;                   /* transferDataSuspended */
+    }
+    p++; n--; streamPos++;
+  }
+  if (n > 0 && ! streamErr) streamErr = flashWrite(p, n);
+  streamPos += n;
+}
+
+/* Abandon a streamed message that did not complete (or was
+ * rejected), undoing whatever part of it reached the flash image.
+ * The ISO-TP reassembly state goes with it, so no later consecutive
+ * frame can pick up the streamed length and overrun buffie. */
+
+void streamAbort(void) {
+  if (! streaming) return;
+  streaming = 0;
+  buffull = bufflen = 0;
+  if (streamErr == NRC_REPEAT) return;
+  dlDone = streamDone;
+  dlCrc = streamCrc;
+}
+
+/* Finish a streamed TransferData message and respond to it */
+
+void streamEnd(int diagId) {
+  if (streamErr == NRC_REPEAT) {
+    streaming = 0;
+    if (debug) printf(" --> TD block %d repeated, not rewritten\n",
+		      streamSeq);
+    sendFrame(diagId, 2, 0x76, streamSeq, 0, 0, 0, 0, 0);
+    return;
+  }
+  if (streamErr) {
+    streamAbort();
+    if (debug) printf(" --> TD block %d rejected, NRC %02X\n",
+		      streamSeq, streamErr);
+    sendFrame(diagId, 3, 0x7f, 0x36, streamErr, 0, 0, 0, 0);
+    return;
+  }
+  streaming = 0;
+  if (debug) printf(" --> TD block %d, %ld/%ld bytes\n",
+		    streamSeq, dlDone, dlSize);
+  sendFrame(diagId, 2, 0x76, streamSeq, 0, 0, 0, 0, 0);
+  dlLast = streamSeq;
+  dlSeq = (dlSeq + 1) & 0xff;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Decode a big-endian field of 'n' bytes (as used by RequestDownload) */
+
+long getBE(const uchar *p, int n) {
+  long v = 0;
+  while (n-- > 0) v = (v << 8) | *p++;
+  return v;
+}
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Convenience macros for comparison purposes */
 
@@ -311,6 +519,72 @@ void udsFrame(int id, int len, uchar *data) {
     UDSmsg("RC 01 01 00");
     sendFrame(diagId, 4, 0x71, 0x01, 0x01, 0x00, 0, 0, 0);
   }
+
+  /* 34 DFI ALFID <addr> <size>  Request Download */
+  else if (len >= 3 && data[0] == 0x34) {
+    int na = data[2] & 0xf;
+    int ns = (data[2] >> 4) & 0xf;
+    UDSmsg("RD Request Download");
+    if (na < 1 || na > 4 || ns < 1 || ns > 4 || len != 3 + na + ns) {
+      sendFrame(diagId, 3, 0x7f, 0x34, 0x13, 0, 0, 0, 0);
+    } else if (dlActive) {
+      sendFrame(diagId, 3, 0x7f, 0x34, 0x70, 0, 0, 0, 0);
+    } else {
+      long addr = getBE(data + 3, na);
+      long size = getBE(data + 3 + na, ns);
+      if (addr < 0 || size < 1 || addr + size > flashSize) {
+	sendFrame(diagId, 3, 0x7f, 0x34, 0x31, 0, 0, 0, 0);
+      } else if (flashOpen() < 0) {
+	sendFrame(diagId, 3, 0x7f, 0x34, 0x22, 0, 0, 0, 0);
+      } else {
+	dlActive = 1;
+	dlAddr = addr;
+	dlSize = size;
+	dlDone = 0;
+	dlSeq = 1;
+	dlLast = -1;
+	dlCrc = 0;
+	if (debug) printf(" --> download %ld bytes at 0x%08lx\n", size, addr);
+	/* maxNumberOfBlockLength: large blocks are streamed, so
+	 * anything isotpFrame() can hold in buffull (an int) */
+	sendFrame(diagId, 6, 0x74, 0x40, 0x7f, 0xff, 0xff, 0xff, 0);
+      }
+    }
+  }
+
+  /* 36 <seq> <data...>  Transfer Data (blocks that fit buffie) */
+  else if (len >= 2 && data[0] == 0x36) {
+    int nrc = 0;
+    UDSmsg("TD Transfer Data");
+    if (! dlActive) nrc = 0x24;
+    else if (data[1] == dlLast) nrc = NRC_REPEAT;
+    else if (data[1] != dlSeq) nrc = 0x73;
+    else nrc = flashWrite(data + 2, len - 2);
+    if (nrc == NRC_REPEAT) {
+      /* Our response was lost, acknowledge the block again */
+      sendFrame(diagId, 2, 0x76, data[1], 0, 0, 0, 0, 0);
+    } else if (nrc) {
+      sendFrame(diagId, 3, 0x7f, 0x36, nrc, 0, 0, 0, 0);
+    } else {
+      sendFrame(diagId, 2, 0x76, data[1], 0, 0, 0, 0, 0);
+      dlLast = data[1];
+      dlSeq = (dlSeq + 1) & 0xff;
+    }
+  }
+
+  /* 37  Request Transfer Exit -- responds with the CRC-32 */
+  else if (len >= 1 && data[0] == 0x37) {
+    UDSmsg("RTE Request Transfer Exit");
+    if (! dlActive || dlDone != dlSize) {
+      sendFrame(diagId, 3, 0x7f, 0x37, 0x24, 0, 0, 0, 0);
+    } else {
+      flashRetire(dlAddr, dlAddr + dlSize + 4095);
+      if (debug) printf(" --> download complete, CRC-32 %08X\n", dlCrc);
+      sendFrame(diagId, 5, 0x77, dlCrc >> 24, dlCrc >> 16, dlCrc >> 8, dlCrc,
+		0, 0);
+    }
+    dlActive = 0;
+  }
   
   /* 3E 00  Tester Present... */
   else if (isUDS2(len, data, 0x3e, 0x00)) {
@@ -353,28 +627,81 @@ void isotpFrame(int id, int dlc, uchar *data) {
 
   if (data[0] < 0x10) {
     if (debug > 2) printf("* ISO-TP: single frame message...\n");
+    /* Any multi-frame message in progress is abandoned */
+    buffull = bufflen = 0;
+    streamAbort();
     udsFrame(id, data[0], data + 1);
 
   } else if (data[0] < 0x20) {
-    int i;
+    int i, hdr = 2;
     if (debug > 1) printf("* ISO-TP: first frame message...\n");
+    streamAbort();
     buffull = ((((int)data[0]) & 0xf) << 8) + (int)data[1];
+    if (buffull == 0 && dlc == 8) {
+      /* Escape sequence: 32-bit length follows (ISO 15765-2:2016) */
+      buffull = (int)getBE(data + 2, 4);
+      hdr = 6;
+    }
     if (debug > 1) printf("*  len: %d\n", buffull);
     bufflen = 0;
-    for (i=2; i<dlc; i++) buffie[bufflen++] = data[i];
+    fcCount = 0;
+    cfSeq = 1;
+    if (buffull < 0 || (buffull > (int)sizeof(buffie) && data[hdr] != 0x36)) {
+      /* Too big to buffer, and not something we can stream */
+      printf("* ISO-TP: message too long, overflow...\n");
+      buffull = 0;
+      sendFrame(0x7d8, 0x32, 0, 0, 0, 0, 0, 0, 0);
+      return;
+    } else if (buffull > (int)sizeof(buffie)) {
+      streamStart();
+      streamData(data + hdr, dlc - hdr);
+      bufflen = dlc - hdr;
+    } else {
+      for (i=hdr; i<dlc; i++) buffie[bufflen++] = data[i];
+    }
     //sendFrame(0x7d8, 0x30, 0, 5, 0, 0, 0, 0, 0);
-    sendFrame(0x7d8, 0x30, 255, 1, 0, 0, 0, 0, 0);
+    sendFrame(0x7d8, 0x30, fcBlockSize,
+	      streaming ? fcStreamSepTime : fcSepTime, 0, 0, 0, 0, 0);
 
   } else if (data[0] < 0x30) {
-    int i;
+    int i, n;
     if (debug > 1) printf("* ISO-TP: consecutive frame message...\n");
     int idx = ((int)data[0]) & 0xf;
     if (debug > 1) printf("*  idx: %d\n", idx);
-    for (i=1; i<dlc && bufflen<buffull; i++) buffie[bufflen++] = data[i];
+    if (bufflen >= buffull) {
+      if (debug) printf("* ISO-TP: unexpected consecutive frame, ignored\n");
+      return;
+    }
+    if (idx != cfSeq) {
+      printf("* ISO-TP: sequence error (%d, expected %d), aborted\n",
+	     idx, cfSeq);
+      buffull = bufflen = 0;
+      streamAbort();
+      return;
+    }
+    cfSeq = (cfSeq + 1) & 0xf;
+    n = dlc - 1;
+    if (n > buffull - bufflen) n = buffull - bufflen;
+    if (streaming) {
+      streamData(data + 1, n);
+      bufflen += n;
+    } else if (bufflen + n > (int)sizeof(buffie)) {
+      printf("* ISO-TP: consecutive frame overruns buffer, aborted\n");
+      buffull = bufflen = 0;
+      return;
+    } else {
+      for (i=1; i<=n; i++) buffie[bufflen++] = data[i];
+    }
     if (debug > 1) printf("*  tot: %d/%d\n", bufflen, buffull);
     if (bufflen == buffull) {
       if (debug > 1) printf("*  ISO-TP long message complete...\n");
-      udsFrame(id, bufflen, buffie);
+      if (streaming) streamEnd(0x7e8);
+      else udsFrame(id, bufflen, buffie);
+    } else if (fcBlockSize && ++fcCount == fcBlockSize) {
+      /* End of block, tester waits for the next flow control */
+      fcCount = 0;
+      sendFrame(0x7d8, 0x30, fcBlockSize,
+		streaming ? fcStreamSepTime : fcSepTime, 0, 0, 0, 0, 0);
     }
 
   } else if (data[0] < 0x40) {